@@ -4,6 +4,54 @@
 #include <limits.h>
 
 
+// FORCE INLINING (used to specialise the route kernel for each direction)
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// DEFERRED CAR MUTATIONS
+// if enabled, new cars are acknowledged immediately but inserted into the car fleet only when its
+// maximum range is needed by a route (or when PENDING_CARS_MAX cars are waiting)
+#ifndef DEFERRED_MUTATIONS
+#define DEFERRED_MUTATIONS 1
+#endif
+
+#define PENDING_CARS_MAX 64
+
+// COMPACT MODE
+// if enabled, all the car fleets share the same sentinel and the car nodes are allocated from a pool:
+// 32 bytes per car instead of a 48 bytes malloc chunk, plus 48 bytes per car fleet (its tree_t) and
+// 272 bytes per car fleet with cars not yet inserted (see "queue_car").
+// Target for 10^7 cars on 10^5 stations: about 330 MB (at most 360 MB if every fleet has pending cars)
+#ifndef COMPACT_MODE
+#define COMPACT_MODE 0
+#endif
+
+#define CAR_POOL_SLAB 4096  // number of car nodes allocated at once by the pool
+
+// REFERENCE ENGINE
+// if enabled, the routes are planned with the original algorithm and the cars are inserted eagerly:
+// this build is the oracle used by the differential fuzzer (see "test/fuzz.c")
+#ifndef REFERENCE_ENGINE
+#define REFERENCE_ENGINE 0
+#endif
+
+#if REFERENCE_ENGINE
+#undef DEFERRED_MUTATIONS
+#define DEFERRED_MUTATIONS 0
+#undef COMPACT_MODE
+#define COMPACT_MODE 0
+#endif
+
+// SOFTWARE PREFETCHING (used while collecting the stations of a route)
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void) 0)
+#endif
+
 // BOOLEAN TYPE
 typedef enum{FALSE = 0, TRUE = 1} bool;
 
@@ -16,22 +64,66 @@ typedef struct node {
                              * if the node is used for a car: key = car_range
                              */
     
-    struct tree *car_fleet; /*
-                             * if the node is used for a station: car_fleet -> car fleet's data structure (see "add_car")
-                             * if the node is used for a car: car_fleet -> NULL (see "insert_node")
-                             */
-    
     color_t color;
     struct node *parent;
     struct node *left;      // left child
     struct node *right;     // right child
-} node_t;
+} node_t;                   // a car is just a node_t
+
+typedef struct station {
+    node_t node;            // must be the first field: the tree functions see a station as a node_t
+    struct tree *car_fleet; // car fleet's data structure (see "add_car"), NULL if it hasn't been created yet
+} station_t;
+
+#define STATION(x) ((station_t *) (x))
 
 typedef struct tree {
     struct node *root;
     node_t *nil;
+    int *pending_cars;      // ranges of the cars not yet inserted in the tree (see "add_car"), NULL if none
+    int pending_count;
+    int node_size;          // sizeof(station_t) for the stations, sizeof(node_t) for the car fleets
 } tree_t;
 
+// CAR NODES POOL (compact mode only)
+typedef struct car_pool {
+    node_t *free_list;      // released car nodes, chained through their "parent" field
+    void *slabs;            // last allocated slab: its first bytes point to the previous one
+    int slab_used;          // car nodes already taken from the last slab
+    int slab_count;
+} car_pool_t;
+
+// sentinel shared by all the car fleets in compact mode
+// its key must stay 0: "find_max_range" returns it as the maximum range of an empty fleet
+node_t shared_car_nil = {.key = 0, .color = BLACK, .parent = &shared_car_nil, .left = &shared_car_nil, .right = &shared_car_nil};
+car_pool_t car_pool = {.free_list = NULL, .slabs = NULL, .slab_used = CAR_POOL_SLAB, .slab_count = 0};
+
+#define IS_COMPACT_FLEET(T) ((T)->nil == &shared_car_nil)
+
+// size of the block actually taken from the heap by malloc(size) (glibc: 8 bytes of header, 16 bytes alignment)
+#define MALLOC_CHUNK(size) (((long) (size) + (long) sizeof(size_t) + 15) / 16 * 16)
+
+// MEMORY REPORT (see "print_memory_usage")
+typedef struct memory_count {
+    long stations;
+    long fleets;
+    long fleet_bytes;       // tree_t and own sentinel of every car fleet
+    long pending_buffers;   // allocated buffers of pending cars
+    long pending_cars;      // cars waiting in the buffers (4 bytes each, already inside the buffers)
+    long cars;              // car nodes in the trees
+} memory_count_t;
+
+// ROUTE BUFFERS: km, maximum range and stages of the stations between start and end, in the direction of travel
+typedef struct route_buffers {
+    int *km;
+    int *max_range;
+    int *max_stages;
+    int *hops;              // number of stages from each station to the end on the best route, INT_MAX if unreachable
+    int capacity;
+} route_buffers_t;
+
+route_buffers_t route_buffers = {.km = NULL, .max_range = NULL, .max_stages = NULL, .hops = NULL, .capacity = 0};
+
 
 // FUNCTION DECLARATIONS
 void    add_station(tree_t *stations, int station_km, int fleet_size);
@@ -39,11 +131,24 @@ void    demolish_station(tree_t *stations, int station_km);
 void    add_car(tree_t *stations, int station_km, int new_car_range, bool print_requested);
 void    scrap_car(tree_t *stations, int station_km, int old_car_range);
 void    plan_route(tree_t *stations, int start_km, int end_km);
+void    print_memory_usage(tree_t *stations);
+#if REFERENCE_ENGINE
+void    plan_route_reference(tree_t *stations, int start_km, int end_km);
 bool    evaluate_route_asc(int max_stages[], int index, int length);
 bool    evaluate_route_des(int max_stages[], int index, int length);
+#endif
+static ALWAYS_INLINE void plan_route_kernel(tree_t *stations, node_t *start_station, node_t *end_station, const bool descending);
+static ALWAYS_INLINE bool evaluate_route(int max_stages[], int hops[], int length, const bool descending);
+int     find_max_range(tree_t *fleet);
+void    grow_route_buffers(void);
+void    delete_route_buffers(void);
 
-tree_t* init_tree(void);
-void    insert_node(tree_t *T, int key);
+tree_t* init_tree(int node_size);
+tree_t* init_fleet(void);
+node_t* alloc_node(tree_t *T);
+void    free_node(tree_t *T, node_t *x);
+void    delete_car_pool(void);
+node_t* insert_node(tree_t *T, int key);
 void    insert_node_fixup(tree_t *T, node_t *z);
 node_t* find_tree_min(tree_t *T, node_t *x);
 node_t* find_tree_max(tree_t *T, node_t *x);
@@ -56,13 +161,19 @@ void    delete_node(tree_t *T, node_t *z);
 void    delete_node_fixup(tree_t *T, node_t *x);
 void    delete_tree(tree_t *T);
 void    delete_tree_aux(tree_t *T, node_t *x);
+void    delete_fleets_aux(tree_t *stations, node_t *x);
+void    queue_car(tree_t *fleet, int car_range);
+bool    unqueue_car(tree_t *fleet, int car_range);
+void    flush_pending_cars(tree_t *fleet);
+void    count_memory_aux(tree_t *stations, node_t *x, memory_count_t *count);
+long    count_nodes_aux(tree_t *T, node_t *x);
 
 
 int main(char* argv[], int argc) {
     char command[20];   // a command is always shorter than 20 chars
     int station_km, fleet_size, new_car_range, old_car_range, start_km, end_km;   // commands' parameters
     
-    tree_t *stations = init_tree(); // stations' data stucture
+    tree_t *stations = init_tree(sizeof(station_t)); // stations' data stucture
     
     // scan the input until the end of the file
     while (!feof(stdin)) {
@@ -112,6 +223,8 @@ int main(char* argv[], int argc) {
                 fprintf(stderr, "Errata lettura degli argomenti di pianifica-percorso\n");
                 exit(1);
             }
+        } else if (strcmp(command, "stampa-memoria") == 0) {
+            print_memory_usage(stations);
         } else {
             fprintf(stderr, "Comando non trovato\n");
             exit(1);
@@ -119,7 +232,10 @@ int main(char* argv[], int argc) {
     }
     
     // free the memory
+    delete_fleets_aux(stations, stations->root);
     delete_tree(stations);
+    delete_car_pool();
+    delete_route_buffers();
     
     return 0;
 }
@@ -128,7 +244,7 @@ int main(char* argv[], int argc) {
 void add_station(tree_t *stations, int station_km, int fleet_size) {
     // add the station if it doesn't exist
     if (search_tree(stations, stations->root, station_km) == NULL) {
-        insert_node(stations, station_km);
+        STATION(insert_node(stations, station_km))->car_fleet = NULL;
         printf("aggiunta\n");
         
         // add the cars
@@ -158,12 +274,14 @@ void add_station(tree_t *stations, int station_km, int fleet_size) {
 }
 
 void demolish_station(tree_t *stations, int station_km) {
-    node_t *target_station = search_tree(stations, stations->root, station_km);
+    station_t *target_station = STATION(search_tree(stations, stations->root, station_km));
     
     // check if the station exists
     if (target_station != NULL) {
-        delete_tree(target_station->car_fleet); // scrap all the cars in the station
-        delete_node(stations, target_station);  // demolish the station
+        if (target_station->car_fleet != NULL) {
+            delete_tree(target_station->car_fleet); // scrap all the cars in the station
+        }
+        delete_node(stations, &target_station->node);   // demolish the station
         printf("demolita\n");
     } else {
         printf("non demolita\n");
@@ -171,17 +289,21 @@ void demolish_station(tree_t *stations, int station_km) {
 }
 
 void add_car(tree_t *stations, int station_km, int new_car_range, bool print_requested) {
-    node_t *target_station = search_tree(stations, stations->root, station_km);
+    station_t *target_station = STATION(search_tree(stations, stations->root, station_km));
     
     // check if the station exists
     if (target_station != NULL) {
         // initialise the car fleet if it hasn't been created yet       
         if (target_station->car_fleet == NULL) {
-            target_station->car_fleet = init_tree();
+            target_station->car_fleet = init_fleet();
         }
         
         // add the car
+#if DEFERRED_MUTATIONS
+        queue_car(target_station->car_fleet, new_car_range);
+#else
         insert_node(target_station->car_fleet, new_car_range);
+#endif
         
         if (print_requested) {
             printf("aggiunta\n");
@@ -194,10 +316,17 @@ void add_car(tree_t *stations, int station_km, int new_car_range, bool print_req
 }
 
 void scrap_car(tree_t *stations, int station_km, int old_car_range) {
-    node_t *target_station = search_tree(stations, stations->root, station_km);
+    station_t *target_station = STATION(search_tree(stations, stations->root, station_km));
     
-    // check if station exists
-    if (target_station != NULL) {
+    // check if station exists and has a car fleet
+    if ((target_station != NULL) && (target_station->car_fleet != NULL)) {
+#if DEFERRED_MUTATIONS
+        // a car still waiting to be inserted can be scrapped without touching the tree
+        if (unqueue_car(target_station->car_fleet, old_car_range) == TRUE) {
+            printf("rottamata\n");
+            return;
+        }
+#endif
         node_t *old_car = search_tree(target_station->car_fleet, target_station->car_fleet->root, old_car_range);
         
         if (old_car != NULL) {
@@ -213,244 +342,341 @@ void scrap_car(tree_t *stations, int station_km, int old_car_range) {
 }
 
 void plan_route(tree_t *stations, int start_km, int end_km) {
+#if REFERENCE_ENGINE
+    plan_route_reference(stations, start_km, end_km);
+#else
     node_t *start_station = search_tree(stations, stations->root, start_km);
     node_t *end_station = search_tree(stations, stations->root, end_km);
     
     if ((start_station != NULL) && (end_station != NULL)) {
         if (start_station == end_station) {
             printf("%d\n", start_km);
+        } else if (start_station->key < end_station->key) {
+            // the direction is a constant: the compiler generates a specialised copy of the kernel for each call
+            plan_route_kernel(stations, start_station, end_station, FALSE);
         } else {
-            // find the direction to establish which function to use
-            node_t* (*find_next_station)(tree_t *, node_t *);
-            bool (*evaluate_route) (int *, int, int);
-            
-            if (start_station->key < end_station->key) {
-                find_next_station = find_next_node;
-                evaluate_route = evaluate_route_asc;
-            } else {
-                find_next_station = find_previous_node;
-                evaluate_route = evaluate_route_des;
-            }
-            
-            // prepare array of intermediate stations
-            node_t *current_station = start_station;
-            int length = 1;
-            
-            while (current_station != end_station) {
-                // count the number of stages between start and end (both included)
-                current_station = find_next_station(stations, current_station);
-                length++;
-            }
-            
-            node_t *inter_stations[length];     // allocate array of intermediate stations
-            
-            current_station = start_station;    // restart from the beginning
-            
-            // fill the array with pointers to intermediate stations
-            for (int i = 0; i < length; i++) {
-                inter_stations[i] = current_station;
-                current_station = find_next_station(stations, current_station);
-            }
-            
-            // calculate the maximum number of stations reachable from the i-th one and put the result into max_stages[i]
-            int dst;
-            int max_range;
-            node_t *max_range_car = NULL;
-            int max_stages[length];
-            
-            for (int i = 0; i < length; i++) {
-                // check if car fleet has been initialised
-                if (inter_stations[i]->car_fleet != NULL) {
-                    max_range_car = find_tree_max(inter_stations[i]->car_fleet, inter_stations[i]->car_fleet->root);
-                    
-                    // check if car fleet is not empty
-                    if (max_range_car != inter_stations[i]->car_fleet->nil) {
-                        max_range = max_range_car->key;
-                    } else {
-                        max_range = 0;
-                    }
-                } else {
-                    max_range = 0;
-                }
-                
-                max_stages[i] = 0;
-                for (int j = i + 1; j < length; j++) {
-                    dst = abs(inter_stations[j]->key - inter_stations[i]->key);
-                    if (dst <= max_range) {
-                        max_stages[i]++;
-                    } else {
-                        break;
-                    }
-                }
-            }
-            
-            // if there's an available route, print the best one
-            if (evaluate_route(max_stages, length - 1, length) == TRUE) {
-                int i = 0;
-                
-                while (max_stages[i] != 0) {
-                    printf("%d ", inter_stations[i]->key);
-                    i = i + max_stages[i];
-                }
-                
-                printf("%d\n", inter_stations[i]->key);   // print end station
-            } else {
-                printf("nessun percorso\n");
-            }
+            plan_route_kernel(stations, start_station, end_station, TRUE);
         }
     } else {
         printf("nessun percorso\n");
     }
+#endif
 }
 
-bool evaluate_route_asc(int max_stages[], int index, int length) {
-    int best_number = 0;
-    int sum = INT_MAX;
-    int new_sum;
-    int i;
-    bool passthrough;
+void print_memory_usage(tree_t *stations) {
+    memory_count_t count = {0, 0, 0, 0, 0, 0};
     
-    while (max_stages[index] > 0) {
-        new_sum = 1;
-        i = index;
-        passthrough = FALSE;
+    count_memory_aux(stations, stations->root, &count);
+    
+    // sizes of the blocks taken from the heap, not of the structures
+    long station_bytes = count.stations * MALLOC_CHUNK(sizeof(station_t)) + MALLOC_CHUNK(sizeof(tree_t)) + MALLOC_CHUNK(sizeof(node_t));
+    long pending_bytes = count.pending_buffers * MALLOC_CHUNK(PENDING_CARS_MAX * sizeof(int));
+    long car_bytes;
+    
+    if (COMPACT_MODE) {
+        // the whole pool is reserved, including the nodes on the free list and the unused part of the last slab
+        car_bytes = car_pool.slab_count * MALLOC_CHUNK(sizeof(void *) + CAR_POOL_SLAB * sizeof(node_t));
+    } else {
+        car_bytes = count.cars * MALLOC_CHUNK(sizeof(node_t));
+    }
+    
+    long all_cars = count.cars + count.pending_cars;
+    
+    // the report goes to stderr to keep the replies on stdout unchanged
+    fprintf(stderr, "stazioni: %ld nodi, %ld byte\n", count.stations, station_bytes);
+    fprintf(stderr, "parchi auto: %ld alberi, %ld byte\n", count.fleets, count.fleet_bytes);
+    fprintf(stderr, "auto in attesa: %ld in %ld buffer, %ld byte\n", count.pending_cars, count.pending_buffers, pending_bytes);
+    fprintf(stderr, "auto: %ld nodi, %ld byte", count.cars, car_bytes);
+    if (COMPACT_MODE) {
+        fprintf(stderr, " (%d blocchi del pool)", car_pool.slab_count);
+    }
+    fprintf(stderr, "\n");
+    fprintf(stderr, "totale: %ld byte", station_bytes + count.fleet_bytes + pending_bytes + car_bytes);
+    if (all_cars > 0) {
+        fprintf(stderr, " (%.1f byte per auto)", (double) (count.fleet_bytes + pending_bytes + car_bytes) / all_cars);
+    }
+    fprintf(stderr, "\n");
+}
+
+static ALWAYS_INLINE void plan_route_kernel(tree_t *stations, node_t *start_station, node_t *end_station, const bool descending) {
+    // collect km and maximum range of the intermediate stations (start and end included) into contiguous arrays
+    // prefetching pipeline: the fleet header is loaded two stations ahead, the fleet root one station ahead
+    node_t *current_station = start_station;
+    node_t *next_station = NULL;
+    node_t *following_station;
+    tree_t *next_fleet;
+    int length = 0;
+    
+    if (start_station != end_station) {
+        next_station = descending ? find_previous_node(stations, start_station) : find_next_node(stations, start_station);
+        PREFETCH(STATION(next_station)->car_fleet);
+    }
+    
+    while (TRUE) {
+        if (length == route_buffers.capacity) {
+            grow_route_buffers();
+        }
         
-        while ((max_stages[i] != 0) && (i != length - 1)) {
-            i = i + max_stages[i];
-            new_sum++;
-            
-            if (new_sum > sum) {
-                passthrough = TRUE;
-                break;
+        if ((next_station != NULL) && (next_station != end_station)) {
+            following_station = descending ? find_previous_node(stations, next_station) : find_next_node(stations, next_station);
+            PREFETCH(STATION(following_station)->car_fleet);
+        } else {
+            following_station = NULL;
+        }
+        
+        if (next_station != NULL) {
+            // the header has been prefetched in the previous iteration: start loading the root of the tree
+            next_fleet = STATION(next_station)->car_fleet;
+            if (next_fleet != NULL) {
+                PREFETCH(next_fleet->root);
             }
         }
         
-        // <= : in case of equal number of stages, choose the smallest jump
-        if ((new_sum <= sum) && (i == length - 1) && (passthrough == FALSE)) {
-            sum = new_sum;
-            best_number = max_stages[index];
+        route_buffers.km[length] = current_station->key;
+        route_buffers.max_range[length] = find_max_range(STATION(current_station)->car_fleet);
+        length++;
+        
+        if (next_station == NULL) {
+            break;
         }
         
-        max_stages[index]--;
+        current_station = next_station;
+        next_station = following_station;
     }
     
-    max_stages[index] = best_number;
+    int *km = route_buffers.km;
+    int *max_range = route_buffers.max_range;
+    int *max_stages = route_buffers.max_stages;
+    int dst;
+    
+    // calculate the maximum number of stations reachable from the i-th one and put the result into max_stages[i]
+    for (int i = 0; i < length; i++) {
+        max_stages[i] = 0;
+        for (int j = i + 1; j < length; j++) {
+            // stations are sorted in the direction of travel: the distance is never negative
+            dst = descending ? (km[i] - km[j]) : (km[j] - km[i]);
+            if (dst <= max_range[i]) {
+                max_stages[i]++;
+            } else {
+                break;
+            }
+        }
+    }
+    
+    // if there's an available route, print the best one
+    if (evaluate_route(max_stages, route_buffers.hops, length, descending) == TRUE) {
+        int i = 0;
         
-    if (index > 0) {
-        return evaluate_route_asc(max_stages, index - 1, length);
-    } else {
-        i = 0;
         while (max_stages[i] != 0) {
+            printf("%d ", km[i]);
             i = i + max_stages[i];
         }
         
-        if (i == length - 1) {
-            return TRUE;
-        } else {
-            return FALSE;
-        }
+        printf("%d\n", km[i]);   // print end station
+    } else {
+        printf("nessun percorso\n");
     }
 }
 
-bool evaluate_route_des(int max_stages[], int index, int length) {
-    int best_number = 0;
-    int sum = INT_MAX;
+int find_max_range(tree_t *fleet) {
+    // check if car fleet has been initialised
+    if (fleet == NULL) {
+        return 0;
+    }
+    
+    flush_pending_cars(fleet);  // the maximum must include the cars not yet inserted
+    
+    // an empty car fleet has the sentinel as maximum, whose key is 0
+    return find_tree_max(fleet, fleet->root)->key;
+}
+
+void grow_route_buffers(void) {
+    // double the capacity of the buffers (they are reused by all the following routes)
+    route_buffers.capacity = (route_buffers.capacity == 0) ? 1024 : 2 * route_buffers.capacity;
+    route_buffers.km = (int *) realloc(route_buffers.km, route_buffers.capacity * sizeof(int));
+    route_buffers.max_range = (int *) realloc(route_buffers.max_range, route_buffers.capacity * sizeof(int));
+    route_buffers.max_stages = (int *) realloc(route_buffers.max_stages, route_buffers.capacity * sizeof(int));
+    route_buffers.hops = (int *) realloc(route_buffers.hops, route_buffers.capacity * sizeof(int));
+}
+
+void delete_route_buffers(void) {
+    free(route_buffers.km);
+    free(route_buffers.max_range);
+    free(route_buffers.max_stages);
+    free(route_buffers.hops);
+    
+    route_buffers.km = NULL;
+    route_buffers.max_range = NULL;
+    route_buffers.max_stages = NULL;
+    route_buffers.hops = NULL;
+    route_buffers.capacity = 0;
+}
+
+static ALWAYS_INLINE bool evaluate_route(int max_stages[], int hops[], int length, const bool descending) {
+    int best_number;
+    int sum;
     int new_sum;
     int i;
     int j;
     int i_old;
     int j_old;
-    bool passthrough;
     
-    while (max_stages[index] > 0) {
-        new_sum = 1;
-        i = index;
-        passthrough = FALSE;
+    hops[length - 1] = 0;
+    
+    // choose the best jump for every station, starting from the one before the end:
+    // the jumps of the following stations are already final, so hops[] gives the length of their route
+    for (int index = length - 2; index >= 0; index--) {
+        best_number = 0;
+        sum = INT_MAX;
         
-        while ((max_stages[i] != 0) && (i != length - 1)) {
-            i = i + max_stages[i];
-            new_sum++;
-            
-            if (new_sum > sum) {
-                passthrough = TRUE;
-                break;
+        for (int jump = max_stages[index]; jump > 0; jump--) {
+            // skip the jumps to stations that can't reach the end
+            if (hops[index + jump] == INT_MAX) {
+                continue;
             }
-        }
-        
-        if ((i == length - 1) && (passthrough == FALSE)) {
+            
+            new_sum = 2 + hops[index + jump];   // this station, the reached one and the stages after it
+            
             if (new_sum < sum) {
                 sum = new_sum;
-                best_number = max_stages[index];
+                best_number = jump;
             } else if (new_sum == sum) {
-                // in case of equal number of stages, look at the following stages to decide
-                i = index + max_stages[index];  // index for proposed new value for best_number
-                j = index + best_number;        // index for saved value of best_number
-                
-                i_old = i;
-                j_old = j;
-                
-                // find the best alternative between best_number and max_stages[i] (= proposed new value for best_number)
-                while (i != length - 1) {
-                    if (i == j) {
-                        // exit from loop when the last common stage has been found...
-                        break;
-                    }
+                if (!descending) {
+                    // in case of equal number of stages, choose the smallest jump
+                    best_number = jump;
+                } else {
+                    // in case of equal number of stages, look at the following stages to decide
+                    i = index + jump;           // index for proposed new value for best_number
+                    j = index + best_number;    // index for saved value of best_number
                     
                     i_old = i;
                     j_old = j;
                     
-                    i = i + max_stages[i];
-                    j = j + max_stages[j];
-                }
-                
-                if (i_old > j_old) {
-                    sum = new_sum;
-                    best_number = max_stages[index];
+                    // find the best alternative between best_number and jump
+                    while (i != length - 1) {
+                        if (i == j) {
+                            // exit from loop when the last common stage has been found...
+                            break;
+                        }
+                        
+                        i_old = i;
+                        j_old = j;
+                        
+                        i = i + max_stages[i];
+                        j = j + max_stages[j];
+                    }
+                    
+                    if (i_old > j_old) {
+                        best_number = jump;
+                    }
                 }
             }
         }
         
-        max_stages[index]--;
+        max_stages[index] = best_number;
+        hops[index] = (best_number > 0) ? (sum - 1) : INT_MAX;
     }
-
-    max_stages[index] = best_number;
-        
-    if (index > 0) {
-        return evaluate_route_des(max_stages, index - 1, length);
+    
+    // check if the chosen jumps lead from the start to the end
+    if (hops[0] != INT_MAX) {
+        return TRUE;
     } else {
-        i = 0;
-        while (max_stages[i] != 0) {
-            i = i + max_stages[i];
-        }
-        
-        if (i == length - 1) {
-            return TRUE;
-        } else {
-            return FALSE;
-        }
+        return FALSE;
     }
 }
 
-tree_t* init_tree(void) {
+tree_t* init_tree(int node_size) {
     // initialising the tree and T->nil node
     tree_t *T = (tree_t *) malloc(sizeof(tree_t));
     T->nil = (node_t *) malloc(sizeof(node_t));
     T->root = T->nil;
+    T->node_size = node_size;
     
     // initialising T->nil's fields
     T->nil->left = T->nil;
     T->nil->right = T->nil;
     T->nil->parent = T->nil;
     T->nil->color = BLACK;
-    T->nil->car_fleet = NULL;
-    T->nil->key = 0;
+    T->nil->key = 0;        // must stay 0: "find_max_range" returns it as the maximum range of an empty fleet
+    
+    // no cars waiting to be inserted
+    T->pending_cars = NULL;
+    T->pending_count = 0;
+    
+    return T;
+}
+
+tree_t* init_fleet(void) {
+#if COMPACT_MODE
+    // the car fleet uses the shared sentinel instead of allocating its own
+    tree_t *T = (tree_t *) malloc(sizeof(tree_t));
+    T->nil = &shared_car_nil;
+    T->root = T->nil;
+    T->node_size = sizeof(node_t);
+    T->pending_cars = NULL;
+    T->pending_count = 0;
     
     return T;
+#else
+    return init_tree(sizeof(node_t));
+#endif
+}
+
+node_t* alloc_node(tree_t *T) {
+    if (!IS_COMPACT_FLEET(T)) {
+        return (node_t *) malloc(T->node_size);
+    }
+    
+    node_t *x;
+    
+    if (car_pool.free_list != NULL) {
+        // reuse a released car node
+        x = car_pool.free_list;
+        car_pool.free_list = x->parent;
+    } else {
+        if (car_pool.slab_used == CAR_POOL_SLAB) {
+            // the last slab is full: allocate a new one and link it to the previous ones
+            void **slab = (void **) malloc(sizeof(void *) + CAR_POOL_SLAB * sizeof(node_t));
+            *slab = car_pool.slabs;
+            car_pool.slabs = slab;
+            car_pool.slab_used = 0;
+            car_pool.slab_count++;
+        }
+        
+        x = (node_t *) ((char *) car_pool.slabs + sizeof(void *) + car_pool.slab_used * sizeof(node_t));
+        car_pool.slab_used++;
+    }
+    
+    return x;
+}
+
+void free_node(tree_t *T, node_t *x) {
+    if (!IS_COMPACT_FLEET(T)) {
+        free(x);
+    } else {
+        // give the car node back to the pool
+        x->parent = car_pool.free_list;
+        car_pool.free_list = x;
+    }
+}
+
+void delete_car_pool(void) {
+    void *slab;
+    
+    while (car_pool.slabs != NULL) {
+        slab = car_pool.slabs;
+        car_pool.slabs = *((void **) slab);
+        free(slab);
+    }
+    
+    car_pool.free_list = NULL;
+    car_pool.slab_used = CAR_POOL_SLAB;
+    car_pool.slab_count = 0;
 }
 
 // ALGORITHM ADAPTED FROM BOOK
-void insert_node(tree_t *T, int key) {
-    node_t *z = (node_t *) malloc(sizeof(node_t)); 
+node_t* insert_node(tree_t *T, int key) {
+    node_t *z = alloc_node(T);
     node_t *y = T->nil;     // y will be parent of z
     node_t *x = T->root;    // node being compared with z
     
@@ -479,8 +705,9 @@ void insert_node(tree_t *T, int key) {
     z->left = T->nil;       // both of z's chidren are the sentinel
     z->right = T->nil;
     z->color = RED;         // the new node starts out RED
-    z->car_fleet = NULL;
     insert_node_fixup(T, z); // correct any violations of rb tree properties
+    
+    return z;
 }
 
 // ALGORITHM ADAPTED FROM BOOK
@@ -678,7 +905,8 @@ void delete_node(tree_t *T, node_t *z) {
     
     if (y != z) {
         z->key = y->key;
-        z->car_fleet = y->car_fleet;
+        // copy the rest of the node (e.g. a station's car fleet), if any
+        memcpy((char *) z + sizeof(node_t), (char *) y + sizeof(node_t), T->node_size - sizeof(node_t));
     }
     
     if (y->color == BLACK) {
@@ -687,7 +915,7 @@ void delete_node(tree_t *T, node_t *z) {
     }
     
     // free the memory
-    free(y);
+    free_node(T, y);
 }
 
 // correct any violations of rb tree properties
@@ -749,7 +977,10 @@ void delete_tree(tree_t *T) {
     node_t *x = T->root;
     
     delete_tree_aux(T, x);
-    free(T->nil);
+    free(T->pending_cars);
+    if (!IS_COMPACT_FLEET(T)) {
+        free(T->nil);
+    }
     free(T);
 }
 
@@ -757,6 +988,319 @@ void delete_tree_aux(tree_t *T, node_t *x) {
     if (x != T->nil) {
         delete_tree_aux(T, x->left);
         delete_tree_aux(T, x->right);
-        free(x);
+        free_node(T, x);
+    }
+}
+
+void delete_fleets_aux(tree_t *stations, node_t *x) {
+    // scrap all the cars of the (sub)tree of stations starting from the node x
+    if (x != stations->nil) {
+        delete_fleets_aux(stations, x->left);
+        delete_fleets_aux(stations, x->right);
+        
+        if (STATION(x)->car_fleet != NULL) {
+            delete_tree(STATION(x)->car_fleet);
+            STATION(x)->car_fleet = NULL;
+        }
+    }
+}
+
+void queue_car(tree_t *fleet, int car_range) {
+    // allocate the buffer of pending cars on the first use
+    if (fleet->pending_cars == NULL) {
+        fleet->pending_cars = (int *) malloc(PENDING_CARS_MAX * sizeof(int));
+    }
+    
+    fleet->pending_cars[fleet->pending_count] = car_range;
+    fleet->pending_count++;
+    
+    // apply the batch when the buffer is full, so that "unqueue_car" scans a bounded number of cars
+    if (fleet->pending_count == PENDING_CARS_MAX) {
+        for (int i = 0; i < PENDING_CARS_MAX; i++) {
+            insert_node(fleet, fleet->pending_cars[i]);
+        }
+        
+        fleet->pending_count = 0;   // the buffer is kept for the next cars
+    }
+}
+
+bool unqueue_car(tree_t *fleet, int car_range) {
+    for (int i = 0; i < fleet->pending_count; i++) {
+        if (fleet->pending_cars[i] == car_range) {
+            // the order of the pending cars doesn't matter: replace the removed one with the last one
+            fleet->pending_count--;
+            fleet->pending_cars[i] = fleet->pending_cars[fleet->pending_count];
+            return TRUE;
+        }
+    }
+    
+    return FALSE;
+}
+
+void flush_pending_cars(tree_t *fleet) {
+    if (fleet->pending_cars != NULL) {
+        // insert all the pending cars and release the buffer
+        for (int i = 0; i < fleet->pending_count; i++) {
+            insert_node(fleet, fleet->pending_cars[i]);
+        }
+        
+        free(fleet->pending_cars);
+        fleet->pending_cars = NULL;
+        fleet->pending_count = 0;
+    }
+}
+
+void count_memory_aux(tree_t *stations, node_t *x, memory_count_t *count) {
+    if (x != stations->nil) {
+        tree_t *fleet = STATION(x)->car_fleet;
+        
+        count->stations++;
+        
+        if (fleet != NULL) {
+            count->fleets++;
+            count->fleet_bytes += MALLOC_CHUNK(sizeof(tree_t));
+            if (!IS_COMPACT_FLEET(fleet)) {
+                count->fleet_bytes += MALLOC_CHUNK(sizeof(node_t));     // own sentinel
+            }
+            if (fleet->pending_cars != NULL) {
+                count->pending_buffers++;
+            }
+            
+            count->pending_cars += fleet->pending_count;
+            count->cars += count_nodes_aux(fleet, fleet->root);
+        }
+        
+        count_memory_aux(stations, x->left, count);
+        count_memory_aux(stations, x->right, count);
+    }
+}
+
+long count_nodes_aux(tree_t *T, node_t *x) {
+    if (x == T->nil) {
+        return 0;
+    }
+    
+    return 1 + count_nodes_aux(T, x->left) + count_nodes_aux(T, x->right);
+}
+
+#if REFERENCE_ENGINE
+// ORIGINAL ROUTE PLANNING ALGORITHM: DO NOT OPTIMISE (it's the oracle for the other engines)
+void plan_route_reference(tree_t *stations, int start_km, int end_km) {
+    node_t *start_station = search_tree(stations, stations->root, start_km);
+    node_t *end_station = search_tree(stations, stations->root, end_km);
+    
+    if ((start_station != NULL) && (end_station != NULL)) {
+        if (start_station == end_station) {
+            printf("%d\n", start_km);
+        } else {
+            // find the direction to establish which function to use
+            node_t* (*find_next_station)(tree_t *, node_t *);
+            bool (*evaluate_route) (int *, int, int);
+            
+            if (start_station->key < end_station->key) {
+                find_next_station = find_next_node;
+                evaluate_route = evaluate_route_asc;
+            } else {
+                find_next_station = find_previous_node;
+                evaluate_route = evaluate_route_des;
+            }
+            
+            // prepare array of intermediate stations
+            node_t *current_station = start_station;
+            int length = 1;
+            
+            while (current_station != end_station) {
+                // count the number of stages between start and end (both included)
+                current_station = find_next_station(stations, current_station);
+                length++;
+            }
+            
+            node_t *inter_stations[length];     // allocate array of intermediate stations
+            
+            current_station = start_station;    // restart from the beginning
+            
+            // fill the array with pointers to intermediate stations
+            for (int i = 0; i < length; i++) {
+                inter_stations[i] = current_station;
+                current_station = find_next_station(stations, current_station);
+            }
+            
+            // calculate the maximum number of stations reachable from the i-th one and put the result into max_stages[i]
+            int dst;
+            int max_range;
+            node_t *max_range_car = NULL;
+            int max_stages[length];
+            
+            for (int i = 0; i < length; i++) {
+                // check if car fleet has been initialised
+                if (STATION(inter_stations[i])->car_fleet != NULL) {
+                    max_range_car = find_tree_max(STATION(inter_stations[i])->car_fleet, STATION(inter_stations[i])->car_fleet->root);
+                    
+                    // check if car fleet is not empty
+                    if (max_range_car != STATION(inter_stations[i])->car_fleet->nil) {
+                        max_range = max_range_car->key;
+                    } else {
+                        max_range = 0;
+                    }
+                } else {
+                    max_range = 0;
+                }
+                
+                max_stages[i] = 0;
+                for (int j = i + 1; j < length; j++) {
+                    dst = abs(inter_stations[j]->key - inter_stations[i]->key);
+                    if (dst <= max_range) {
+                        max_stages[i]++;
+                    } else {
+                        break;
+                    }
+                }
+            }
+            
+            // if there's an available route, print the best one
+            if (evaluate_route(max_stages, length - 1, length) == TRUE) {
+                int i = 0;
+                
+                while (max_stages[i] != 0) {
+                    printf("%d ", inter_stations[i]->key);
+                    i = i + max_stages[i];
+                }
+                
+                printf("%d\n", inter_stations[i]->key);   // print end station
+            } else {
+                printf("nessun percorso\n");
+            }
+        }
+    } else {
+        printf("nessun percorso\n");
+    }
+}
+
+bool evaluate_route_asc(int max_stages[], int index, int length) {
+    int best_number = 0;
+    int sum = INT_MAX;
+    int new_sum;
+    int i;
+    bool passthrough;
+    
+    while (max_stages[index] > 0) {
+        new_sum = 1;
+        i = index;
+        passthrough = FALSE;
+        
+        while ((max_stages[i] != 0) && (i != length - 1)) {
+            i = i + max_stages[i];
+            new_sum++;
+            
+            if (new_sum > sum) {
+                passthrough = TRUE;
+                break;
+            }
+        }
+        
+        // <= : in case of equal number of stages, choose the smallest jump
+        if ((new_sum <= sum) && (i == length - 1) && (passthrough == FALSE)) {
+            sum = new_sum;
+            best_number = max_stages[index];
+        }
+        
+        max_stages[index]--;
+    }
+    
+    max_stages[index] = best_number;
+        
+    if (index > 0) {
+        return evaluate_route_asc(max_stages, index - 1, length);
+    } else {
+        i = 0;
+        while (max_stages[i] != 0) {
+            i = i + max_stages[i];
+        }
+        
+        if (i == length - 1) {
+            return TRUE;
+        } else {
+            return FALSE;
+        }
+    }
+}
+
+bool evaluate_route_des(int max_stages[], int index, int length) {
+    int best_number = 0;
+    int sum = INT_MAX;
+    int new_sum;
+    int i;
+    int j;
+    int i_old;
+    int j_old;
+    bool passthrough;
+    
+    while (max_stages[index] > 0) {
+        new_sum = 1;
+        i = index;
+        passthrough = FALSE;
+        
+        while ((max_stages[i] != 0) && (i != length - 1)) {
+            i = i + max_stages[i];
+            new_sum++;
+            
+            if (new_sum > sum) {
+                passthrough = TRUE;
+                break;
+            }
+        }
+        
+        if ((i == length - 1) && (passthrough == FALSE)) {
+            if (new_sum < sum) {
+                sum = new_sum;
+                best_number = max_stages[index];
+            } else if (new_sum == sum) {
+                // in case of equal number of stages, look at the following stages to decide
+                i = index + max_stages[index];  // index for proposed new value for best_number
+                j = index + best_number;        // index for saved value of best_number
+                
+                i_old = i;
+                j_old = j;
+                
+                // find the best alternative between best_number and max_stages[i] (= proposed new value for best_number)
+                while (i != length - 1) {
+                    if (i == j) {
+                        // exit from loop when the last common stage has been found...
+                        break;
+                    }
+                    
+                    i_old = i;
+                    j_old = j;
+                    
+                    i = i + max_stages[i];
+                    j = j + max_stages[j];
+                }
+                
+                if (i_old > j_old) {
+                    sum = new_sum;
+                    best_number = max_stages[index];
+                }
+            }
+        }
+        
+        max_stages[index]--;
+    }
+
+    max_stages[index] = best_number;
+        
+    if (index > 0) {
+        return evaluate_route_des(max_stages, index - 1, length);
+    } else {
+        i = 0;
+        while (max_stages[i] != 0) {
+            i = i + max_stages[i];
+        }
+        
+        if (i == length - 1) {
+            return TRUE;
+        } else {
+            return FALSE;
+        }
     }
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,570 @@
+/*
+ * DIFFERENTIAL FUZZER
+ * Generates random (and deliberately adversarial) command traces, runs them through the reference
+ * engine and through every other engine, and checks that the outputs are byte-for-byte identical.
+ * A mismatching trace is shrunk to a minimal one (no command can be removed without hiding the
+ * mismatch), printed and saved to "fuzz_failure.txt".
+ *
+ * Build (from the root of the repository):
+ *     gcc -O2 -o reference -DREFERENCE_ENGINE=1 code.c
+ *     gcc -O2 -o optimised code.c
+ *     gcc -O2 -o compact -DCOMPACT_MODE=1 code.c
+ *     gcc -O2 -o fuzz test/fuzz.c
+ *
+ * Usage:
+ *     ./fuzz [-n traces] [-b benchmark traces] [-s seed] ./reference ./optimised ./compact
+ *
+ * Every LARGE_TRACE_PERIOD-th trace is a large one (thousands of stations and commands). After the
+ * comparison, every engine is timed on a separate set of benchmark traces (one per family, repeated
+ * "-b" times, 0 to skip it), large enough that the start of the process is negligible, and on two
+ * traces with DIRECTION_STATIONS stations and long routes only in ascending or descending direction.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+
+// BOOLEAN TYPE
+typedef enum{FALSE = 0, TRUE = 1} bool;
+
+// TRACE: list of commands, one per line
+typedef struct trace {
+    char **lines;
+    int count;
+    int capacity;
+} trace_t;
+
+// FAMILIES OF GENERATED TRACES
+typedef enum {
+    RANDOM = 0,     // sparse stations, random ranges
+    DENSE = 1,      // stations on consecutive km
+    TIES = 2,       // few distinct ranges: many routes with the same number of stages
+    CORRIDOR = 3,   // equally spaced stations with ranges close to the gap: long routes
+    HOT = 4,        // one or two stations receiving long bursts of car updates between routes
+    FAMILIES = 5
+} family_t;
+
+// SIZE OF THE GENERATED TRACES
+typedef struct trace_size {
+    int min_stations;
+    int max_stations;
+    int min_commands;
+    int max_commands;
+} trace_size_t;
+
+// ENGINE STATISTICS
+typedef struct engine {
+    char *path;
+    long commands;      // commands executed
+    double seconds;     // total running time on the benchmark traces
+    double direction_seconds[2];    // running time on the ascending and on the descending routes
+} engine_t;
+
+#define LARGE_TRACE_PERIOD 50
+#define DIRECTION_STATIONS 3000
+#define DIRECTION_ROUTES 300
+
+const trace_size_t SMALL_TRACE = {2, 64, 20, 170};
+const trace_size_t LARGE_TRACE = {1000, 5000, 2000, 6000};
+const trace_size_t BENCHMARK_TRACE = {4000, 4000, 4000, 4000};
+
+
+// FUNCTION DECLARATIONS
+unsigned int next_random(unsigned int *state);
+int     random_range(unsigned int *state, family_t family, int gap);
+void    generate_trace(trace_t *t, unsigned int *state, trace_size_t size, family_t family);
+void    generate_direction_trace(trace_t *t, unsigned int *state, bool descending);
+
+void    init_trace(trace_t *t);
+void    append_line(trace_t *t, const char *line);
+void    delete_trace(trace_t *t);
+void    write_trace(trace_t *t, const char *path);
+
+double  run_engine(engine_t *e, const char *input_path, const char *output_path, int *status);
+char*   read_file(const char *path, long *length);
+bool    outputs_differ(engine_t *reference, engine_t *candidate, trace_t *t);
+bool    files_differ(int reference_status, int candidate_status);
+void    shrink_trace(engine_t *reference, engine_t *candidate, trace_t *t);
+void    report_mismatch(engine_t *reference, engine_t *candidate, trace_t *t, const char *name);
+void    run_benchmark(engine_t engines[], int engine_count, int repetitions, unsigned int *state);
+void    time_trace(engine_t engines[], int engine_count, trace_t *t, int direction, const char *name);
+
+
+char trace_path[64], reference_path[64], candidate_path[64];   // temporary files
+
+
+int main(int argc, char *argv[]) {
+    int traces = 1000;
+    int repetitions = 1;
+    unsigned int seed = (unsigned int) time(NULL);
+    int option;
+    
+    while ((option = getopt(argc, argv, "n:b:s:")) != -1) {
+        if (option == 'n') {
+            traces = atoi(optarg);
+        } else if (option == 'b') {
+            repetitions = atoi(optarg);
+        } else if (option == 's') {
+            seed = (unsigned int) strtoul(optarg, NULL, 10);
+        } else {
+            fprintf(stderr, "Uso: %s [-n tracce] [-b tracce di benchmark] [-s seme] riferimento motore...\n", argv[0]);
+            exit(1);
+        }
+    }
+    
+    if (argc - optind < 2) {
+        fprintf(stderr, "Uso: %s [-n tracce] [-b tracce di benchmark] [-s seme] riferimento motore...\n", argv[0]);
+        exit(1);
+    }
+    
+    int engine_count = argc - optind;
+    engine_t engines[engine_count];     // engines[0] is the reference
+    
+    for (int i = 0; i < engine_count; i++) {
+        engines[i].path = argv[optind + i];
+        engines[i].commands = 0;
+        engines[i].seconds = 0;
+        engines[i].direction_seconds[0] = 0;
+        engines[i].direction_seconds[1] = 0;
+    }
+    
+    snprintf(trace_path, sizeof(trace_path), "/tmp/fuzz_%d_trace.txt", (int) getpid());
+    snprintf(reference_path, sizeof(reference_path), "/tmp/fuzz_%d_reference.txt", (int) getpid());
+    snprintf(candidate_path, sizeof(candidate_path), "/tmp/fuzz_%d_candidate.txt", (int) getpid());
+    
+    printf("seme: %u\n", seed);
+    
+    unsigned int state = (seed != 0) ? seed : 1;    // the generator must not start from 0
+    trace_t t;
+    char name[32];
+    
+    for (int n = 0; n < traces; n++) {
+        trace_size_t size = ((n + 1) % LARGE_TRACE_PERIOD == 0) ? LARGE_TRACE : SMALL_TRACE;
+        
+        init_trace(&t);
+        generate_trace(&t, &state, size, next_random(&state) % FAMILIES);
+        
+        // run every engine on the same trace and compare it with the reference
+        for (int i = 1; i < engine_count; i++) {
+            if (outputs_differ(&engines[0], &engines[i], &t)) {
+                snprintf(name, sizeof(name), "traccia %d", n);
+                report_mismatch(&engines[0], &engines[i], &t, name);
+            }
+        }
+        
+        delete_trace(&t);
+    }
+    
+    printf("%d tracce identiche\n", traces);
+    
+    if (repetitions > 0) {
+        run_benchmark(engines, engine_count, repetitions, &state);
+    }
+    
+    remove(trace_path);
+    remove(reference_path);
+    remove(candidate_path);
+    
+    return 0;
+}
+
+
+// XORSHIFT GENERATOR: the same seed always gives the same traces
+unsigned int next_random(unsigned int *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+int random_range(unsigned int *state, family_t family, int gap) {
+    switch (family) {
+        case DENSE:
+            return next_random(state) % 6;
+        case TIES:
+            return 5 * (next_random(state) % 4);
+        case CORRIDOR: {
+            // mostly exactly the gap (or a multiple of it), sometimes one km short
+            // (two separate statements: the order of the calls must not depend on the compiler)
+            int multiple = 1 + next_random(state) % 3;
+            int short_by = (next_random(state) % 4 == 0);
+            return gap * multiple - short_by;
+        }
+        default:
+            return next_random(state) % 300;
+    }
+}
+
+void generate_trace(trace_t *t, unsigned int *state, trace_size_t size, family_t family) {
+    char line[1024];
+    int length;
+    
+    int station_count = size.min_stations + next_random(state) % (size.max_stations - size.min_stations + 1);
+    int gap = 5 + next_random(state) % 20;
+    int base = next_random(state) % 100;
+    int *km = (int *) malloc(station_count * sizeof(int));
+    
+    // choose the position of the stations (duplicates are allowed: "non aggiunta")
+    for (int i = 0; i < station_count; i++) {
+        switch (family) {
+            case DENSE:
+                km[i] = base + i;
+                break;
+            case TIES:
+                km[i] = next_random(state) % (station_count + 60);
+                break;
+            case CORRIDOR:
+                km[i] = base + gap * i;
+                break;
+            default:
+                km[i] = next_random(state) % (16 * station_count + 1000);
+        }
+    }
+    
+    // add the stations in random order, each with a small fleet
+    for (int i = 0; i < station_count; i++) {
+        int j = next_random(state) % station_count;
+        int swap = km[i];
+        km[i] = km[j];
+        km[j] = swap;
+    }
+    
+    for (int i = 0; i < station_count; i++) {
+        int fleet_size = next_random(state) % 5;
+        
+        length = snprintf(line, sizeof(line), "aggiungi-stazione %d %d", km[i], fleet_size);
+        for (int j = 0; j < fleet_size; j++) {
+            length += snprintf(line + length, sizeof(line) - length, " %d", random_range(state, family, gap));
+        }
+        append_line(t, line);
+    }
+    
+    // mix of car updates, demolitions and routes in both directions
+    int command_count = size.min_commands + next_random(state) % (size.max_commands - size.min_commands + 1);
+    int last_range = 0;
+    int hot[2] = {km[0], km[station_count - 1]};    // the stations receiving the bursts of the HOT family
+    int burst = 0;
+    
+    for (int n = 0; n < command_count; n++) {
+        int station = km[next_random(state) % station_count];
+        int other = km[next_random(state) % station_count];
+        int choice = next_random(state) % 100;
+        
+        if (family == HOT) {
+            // bursts longer than the buffer of pending cars (64), then a route through the hot stations
+            if (burst == 0) {
+                burst = 65 + next_random(state) % 200;
+                snprintf(line, sizeof(line), "pianifica-percorso %d %d", hot[next_random(state) % 2], other);
+                append_line(t, line);
+                continue;
+            }
+            
+            burst--;
+            station = hot[next_random(state) % 2];
+            choice = (choice < 60) ? 0 : 30;    // 60% new cars, 40% scrapped cars
+        }
+        
+        if (choice < 30) {
+            last_range = random_range(state, family, gap);
+            snprintf(line, sizeof(line), "aggiungi-auto %d %d", station, last_range);
+        } else if (choice < 55) {
+            // often scrap a car that has just been added (possibly a duplicate range)
+            int range = (next_random(state) % 2) ? last_range : random_range(state, family, gap);
+            snprintf(line, sizeof(line), "rottama-auto %d %d", station, range);
+        } else if (choice < 60) {
+            snprintf(line, sizeof(line), "demolisci-stazione %d", station);
+        } else if (choice < 65) {
+            snprintf(line, sizeof(line), "aggiungi-stazione %d 1 %d", station, random_range(state, family, gap));
+        } else {
+            snprintf(line, sizeof(line), "pianifica-percorso %d %d", station, other);
+        }
+        append_line(t, line);
+    }
+    
+    free(km);
+}
+
+void init_trace(trace_t *t) {
+    t->count = 0;
+    t->capacity = 64;
+    t->lines = (char **) malloc(t->capacity * sizeof(char *));
+}
+
+void append_line(trace_t *t, const char *line) {
+    // double the array of lines if it's full
+    if (t->count == t->capacity) {
+        t->capacity *= 2;
+        t->lines = (char **) realloc(t->lines, t->capacity * sizeof(char *));
+    }
+    
+    t->lines[t->count] = strdup(line);
+    t->count++;
+}
+
+void delete_trace(trace_t *t) {
+    for (int i = 0; i < t->count; i++) {
+        free(t->lines[i]);
+    }
+    
+    free(t->lines);
+}
+
+void write_trace(trace_t *t, const char *path) {
+    FILE *f = fopen(path, "w");
+    
+    if (f == NULL) {
+        fprintf(stderr, "Impossibile scrivere %s\n", path);
+        exit(1);
+    }
+    
+    for (int i = 0; i < t->count; i++) {
+        fprintf(f, "%s\n", t->lines[i]);
+    }
+    
+    fclose(f);
+}
+
+double run_engine(engine_t *e, const char *input_path, const char *output_path, int *status) {
+    struct timespec start, end;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        // child: input and output redirected to the temporary files
+        int input = open(input_path, O_RDONLY);
+        int output = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        
+        dup2(input, STDIN_FILENO);
+        dup2(output, STDOUT_FILENO);
+        close(input);
+        close(output);
+        
+        execl(e->path, e->path, (char *) NULL);
+        _exit(127);     // the engine couldn't be started
+    } else if (pid < 0) {
+        fprintf(stderr, "Impossibile avviare %s\n", e->path);
+        exit(1);
+    }
+    
+    waitpid(pid, status, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+char* read_file(const char *path, long *length) {
+    FILE *f = fopen(path, "rb");
+    
+    if (f == NULL) {
+        fprintf(stderr, "Impossibile leggere %s\n", path);
+        exit(1);
+    }
+    
+    fseek(f, 0, SEEK_END);
+    *length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    
+    char *content = (char *) malloc(*length + 1);
+    
+    if (fread(content, 1, *length, f) != (size_t) *length) {
+        fprintf(stderr, "Errata lettura di %s\n", path);
+        exit(1);
+    }
+    
+    fclose(f);
+    return content;
+}
+
+bool outputs_differ(engine_t *reference, engine_t *candidate, trace_t *t) {
+    int reference_status, candidate_status;
+    
+    write_trace(t, trace_path);
+    
+    run_engine(reference, trace_path, reference_path, &reference_status);
+    run_engine(candidate, trace_path, candidate_path, &candidate_status);
+    
+    return files_differ(reference_status, candidate_status);
+}
+
+bool files_differ(int reference_status, int candidate_status) {
+    long reference_length, candidate_length;
+    char *reference_output = read_file(reference_path, &reference_length);
+    char *candidate_output = read_file(candidate_path, &candidate_length);
+    
+    // a crash or an error exit counts as a different output
+    bool differ = (reference_status != candidate_status) || (reference_length != candidate_length) ||
+                  (memcmp(reference_output, candidate_output, reference_length) != 0);
+    
+    free(reference_output);
+    free(candidate_output);
+    
+    return differ;
+}
+
+// DELTA DEBUGGING: remove blocks of commands while the mismatch persists, halving the block size
+void shrink_trace(engine_t *reference, engine_t *candidate, trace_t *t) {
+    trace_t smaller;
+    int block = t->count / 2;
+    bool removed;
+    
+    while (block > 0) {
+        removed = FALSE;
+        
+        for (int start = 0; start < t->count; ) {
+            // build the trace without the commands in [start, start + block)
+            init_trace(&smaller);
+            for (int i = 0; i < t->count; i++) {
+                if ((i < start) || (i >= start + block)) {
+                    append_line(&smaller, t->lines[i]);
+                }
+            }
+            
+            if ((smaller.count > 0) && outputs_differ(reference, candidate, &smaller)) {
+                // the mismatch is still there: keep the smaller trace and try the same position again
+                delete_trace(t);
+                *t = smaller;
+                removed = TRUE;
+            } else {
+                delete_trace(&smaller);
+                start += block;
+            }
+        }
+        
+        // the block size is halved only when no block of this size can be removed
+        if (!removed) {
+            block /= 2;
+        }
+    }
+}
+
+void report_mismatch(engine_t *reference, engine_t *candidate, trace_t *t, const char *name) {
+    printf("%s: %s differisce da %s, riduzione in corso...\n", name, candidate->path, reference->path);
+    
+    shrink_trace(reference, candidate, t);
+    write_trace(t, "fuzz_failure.txt");
+    
+    printf("traccia minima (%d comandi, salvata in fuzz_failure.txt):\n", t->count);
+    for (int j = 0; j < t->count; j++) {
+        printf("%s\n", t->lines[j]);
+    }
+    
+    delete_trace(t);
+    remove(trace_path);
+    remove(reference_path);
+    remove(candidate_path);
+    exit(1);
+}
+
+// THROUGHPUT: every engine runs the same large traces (one per family, then one ascending and one descending
+// trace on the same network) and its output is checked too
+void run_benchmark(engine_t engines[], int engine_count, int repetitions, unsigned int *state) {
+    trace_t t;
+    char name[32];
+    
+    for (int r = 0; r < repetitions; r++) {
+        // one trace per family
+        for (family_t family = 0; family < FAMILIES; family++) {
+            init_trace(&t);
+            generate_trace(&t, state, BENCHMARK_TRACE, family);
+            snprintf(name, sizeof(name), "benchmark %d", r * FAMILIES + family);
+            time_trace(engines, engine_count, &t, -1, name);
+            delete_trace(&t);
+        }
+        
+        // the same network with routes in only one direction
+        unsigned int network = next_random(state);
+        
+        for (int direction = 0; direction < 2; direction++) {
+            unsigned int direction_state = network;
+            
+            init_trace(&t);
+            generate_direction_trace(&t, &direction_state, direction);
+            snprintf(name, sizeof(name), "benchmark %s %d", direction ? "discendente" : "ascendente", r);
+            time_trace(engines, engine_count, &t, direction, name);
+            delete_trace(&t);
+        }
+    }
+    
+    printf("benchmark per famiglia: %d tracce\n", repetitions * FAMILIES);
+    for (int i = 0; i < engine_count; i++) {
+        printf("%s: %ld comandi in %.3f s (%.0f comandi/s, %.2fx rispetto al riferimento)\n",
+               engines[i].path, engines[i].commands, engines[i].seconds, engines[i].commands / engines[i].seconds,
+               engines[0].seconds / engines[i].seconds);
+    }
+    
+    printf("benchmark per direzione: %d tracce, %d stazioni, %d percorsi per traccia\n", 2 * repetitions,
+           DIRECTION_STATIONS, DIRECTION_ROUTES);
+    for (int i = 0; i < engine_count; i++) {
+        printf("%s: ascendente %.3f s (%.2fx), discendente %.3f s (%.2fx)\n", engines[i].path,
+               engines[i].direction_seconds[0], engines[0].direction_seconds[0] / engines[i].direction_seconds[0],
+               engines[i].direction_seconds[1], engines[0].direction_seconds[1] / engines[i].direction_seconds[1]);
+    }
+}
+
+// run all the engines on the trace, adding the time to the totals (direction = -1) or to the given direction
+void time_trace(engine_t engines[], int engine_count, trace_t *t, int direction, const char *name) {
+    int reference_status, candidate_status;
+    double seconds;
+    
+    write_trace(t, trace_path);
+    
+    for (int i = 0; i < engine_count; i++) {
+        if (i == 0) {
+            seconds = run_engine(&engines[0], trace_path, reference_path, &reference_status);
+        } else {
+            seconds = run_engine(&engines[i], trace_path, candidate_path, &candidate_status);
+        }
+        
+        if (direction < 0) {
+            engines[i].seconds += seconds;
+            engines[i].commands += t->count;
+        } else {
+            engines[i].direction_seconds[direction] += seconds;
+        }
+        
+        if ((i > 0) && files_differ(reference_status, candidate_status)) {
+            report_mismatch(&engines[0], &engines[i], t, name);
+        }
+    }
+}
+
+// sparse stations with a few long-range cars each, long routes from the first quarter to the last one (or back)
+void generate_direction_trace(trace_t *t, unsigned int *state, bool descending) {
+    char line[1024];
+    int length;
+    int km[DIRECTION_STATIONS];
+    
+    for (int i = 0; i < DIRECTION_STATIONS; i++) {
+        // strictly increasing km with random gaps
+        km[i] = ((i > 0) ? km[i - 1] : 0) + 1 + next_random(state) % 1300;
+        
+        int fleet_size = 1 + next_random(state) % 6;
+        
+        length = snprintf(line, sizeof(line), "aggiungi-stazione %d %d", km[i], fleet_size);
+        for (int j = 0; j < fleet_size; j++) {
+            length += snprintf(line + length, sizeof(line) - length, " %d", 500 + (int) (next_random(state) % 11500));
+        }
+        append_line(t, line);
+    }
+    
+    for (int n = 0; n < DIRECTION_ROUTES; n++) {
+        int near = next_random(state) % (DIRECTION_STATIONS / 4);
+        int far = DIRECTION_STATIONS - 1 - next_random(state) % (DIRECTION_STATIONS / 4);
+        
+        if (descending) {
+            snprintf(line, sizeof(line), "pianifica-percorso %d %d", km[far], km[near]);
+        } else {
+            snprintf(line, sizeof(line), "pianifica-percorso %d %d", km[near], km[far]);
+        }
+        append_line(t, line);
+    }
+}